@@ -15,13 +15,18 @@
  * limitations under the License.
  */
 /** \file main.cpp
- *  \brief An example UDP Time application
- *  This application reads the current UTC time by sending a packet to
- *  utcnist.colorado.edu (128.138.140.44)
+ *  \brief An example SNTP Time application
+ *  This application reads the current UTC time from utcnist.colorado.edu
+ *  (128.138.140.44) using SNTP (NTPv4 client mode, RFC 4330 / RFC 5905).
  *
  *  This example is implemented as a logic class (UDPGetTime) wrapping a UDP socket.
  *  The logic class handles all events, leaving the main loop to just check if the process
  *  has finished.
+ *
+ *  UDPGetTime sends a short burst of SNTP requests. Each reply yields the four
+ *  exchange timestamps, from which the clock offset and round-trip delay are
+ *  computed. The sample with the lowest delay is kept, since it is the one least
+ *  disturbed by queueing in the network.
  */
 #include "mbed-drivers/mbed.h"
 #include "EthernetInterface.h"
@@ -30,6 +35,7 @@
 #include "minar/minar.h"
 #include "core-util/FunctionPointer.h"
 
+#include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -37,21 +43,93 @@
 /* TODO: Remove when yotta supports init. */
 #include "sal-stack-lwip/lwipv4_init.h"
 
-#define UDP_TIME_PORT 37
+#define SNTP_PORT 123
+/* Number of successful exchanges to collect before selecting a sample */
+#define SNTP_SAMPLES 8
+/* Give up after this many requests, whether answered or not */
+#define SNTP_MAX_ATTEMPTS (3 * SNTP_SAMPLES)
+/* Spacing between exchanges in the burst */
+#define SNTP_BURST_INTERVAL_MS 500
+/* Resend period when a request goes unanswered */
+#define SNTP_RETRY_MS 1000
+/* Largest round-trip delay accepted as a pass by the test */
+#define SNTP_MAX_DELAY_MS 1000
+/* The 32-bit microsecond Timer wraps after ~71 minutes; poll it well within that */
+#define CLOCK_POLL_MS (10 * 60 * 1000)
 
 namespace {
      const char *HTTP_SERVER_NAME = "utcnist.colorado.edu";
      /*const char *HTTP_SERVER_NAME = "128.138.140.44";*/
+     /* To test against the local NTP stand-in below, use the host's address: */
+     /*const char *HTTP_SERVER_NAME = "192.168.2.1";*/
      const float YEARS_TO_PASS = 115.0;
+
+     const size_t SNTP_PACKET_SIZE = 48;
+     /* LI = 0 (no warning), VN = 4, Mode = 3 (client) */
+     const uint8_t SNTP_CLIENT_HEADER = (0 << 6) | (4 << 3) | 3;
+     const uint8_t SNTP_MODE_SERVER = 4;
+     const uint8_t SNTP_LI_ALARM = 3;
+     const uint8_t SNTP_STRATUM_MAX = 15;
+     /* Byte offsets of fields within an NTP packet */
+     const size_t SNTP_REFID_OFFSET = 12;
+     const size_t SNTP_ORIGINATE_OFFSET = 24;
+     const size_t SNTP_RECEIVE_OFFSET = 32;
+     const size_t SNTP_TRANSMIT_OFFSET = 40;
 }
 
+/* Python NTP stand-in
+ *
+ * Answers SNTP requests with the host's clock, so the example can be tested
+ * without access to a public time server. Works with Python 2 and 3. Binding to
+ * port 123 requires root; run it on the host connected to the board and point
+ * HTTP_SERVER_NAME at it.
+ *
+#!/usr/bin/python
+import socket, struct, time
+
+NTP_PORT = 123
+NTP_EPOCH_OFFSET = 2208988800
+
+def ntp_now():
+    t = time.time() + NTP_EPOCH_OFFSET
+    return (int(t), int((t - int(t)) * 2**32) & 0xffffffff)
+
+def serve(port):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.bind(('', port))
+    while True:
+        raw, addr = s.recvfrom(512)
+        rx = ntp_now()
+        data = bytearray(raw)
+        if len(data) < 48 or (data[0] & 7) != 3:
+            continue
+        # LI=0, VN=4, Mode=4 (server), stratum 1, poll, precision 2^-20
+        hdr = struct.pack('!BBBb', (4 << 3) | 4, 1, data[2], -20)
+        # root delay, root dispersion, reference ID "LOCL"
+        hdr += struct.pack('!II', 0, 0) + b'LOCL'
+        ref = struct.pack('!II', *rx)
+        # originate = client's transmit timestamp
+        org = raw[40:48]
+        pkt = hdr + ref + org + struct.pack('!II', *rx)
+        pkt += struct.pack('!II', *ntp_now())
+        s.sendto(pkt, addr)
+
+if __name__ == '__main__':
+    serve(NTP_PORT)
+ */
+
 using namespace mbed::Sockets::v0;
 
 #define ief_check()
     //printf("%s:%d Interrupts are %s\r\n",__FILE__,__LINE__,(__get_PRIMASK()?"Disabled":"Enabled"))
 
 /**
- * \brief UDPGetTime implements the logic for fetching the UTC time over UDP
+ * \brief UDPGetTime implements the logic for fetching the UTC time over SNTP
+ *
+ * All timestamps are NTP 64-bit fixed point values: seconds since
+ * 1900-01-01T00:00:00 in the upper 32 bits, fractions of a second in the lower 32.
+ * Local timestamps are read from a free-running Timer, so the offset of a sample
+ * is the NTP time at which that Timer read zero.
  */
 class UDPGetTime {
 public:
@@ -64,9 +142,23 @@ public:
      */
     UDPGetTime() :
         sock(SOCKET_STACK_LWIP_IPV4),
-        _udpTimePort(UDP_TIME_PORT),
-        _time(0)
+        _udpTimePort(SNTP_PORT),
+        _time(0),
+        _retryHandle(NULL),
+        _lastUs(0),
+        _usHigh(0),
+        _offset(0),
+        _delay(0),
+        _jitter(0),
+        _lastTransmit(0),
+        _nSamples(0),
+        _nAttempts(0),
+        _done(false)
     {
+        _clock.start();
+        /* Keep the wrap count of the local clock up to date */
+        mbed::util::FunctionPointer0<void> fp(this, &UDPGetTime::pollClock);
+        minar::Scheduler::postCallback(fp.bind()).period(minar::milliseconds(CLOCK_POLL_MS));
         /* Open the UDP socket so that DNS will work */
         sock.open(SOCKET_AF_INET4);
     }
@@ -78,6 +170,9 @@ public:
     void startGetTime(const char *address) {
         /* Initialize the GetTime flags */
         resolved = false;
+        _done = false;
+        _nSamples = 0;
+        _nAttempts = 0;
         printf("Starting DNS Query for %s\r\n", address);
         /* Start the DNS operation */
         socket_error_t rc = sock.resolve(address,Socket::DNSHandler_t(this, &UDPGetTime::onDNS));
@@ -85,24 +180,125 @@ public:
     }
     /**
      * Gets the time response.
-     * Once the response has been received from the remote host, getTime() can be used
-     * to extract the time from UDPGetTime
-     * @return The 32-bit time since 1970-01-01T00:00:00 in seconds.
+     * Once the burst has completed, getTime() can be used to extract the time
+     * from UDPGetTime
+     * @return The 32-bit time since 1900-01-01T00:00:00 in seconds.
      */
     uint32_t time() { return _time;}
+    /**
+     * Gets the current time with sub-second precision.
+     * Only valid once the burst has completed.
+     * @return The current NTP 64-bit timestamp
+     */
+    uint64_t now() { return _offset + localTime(); }
+    /**
+     * Gets the round-trip delay of the selected sample.
+     * @return The delay in NTP 32.32 fixed point seconds
+     */
+    int64_t delay() { return _delay; }
 protected:
+    /**
+     * Reads the local clock
+     * The 32-bit Timer is extended to 64 bits by counting its wraps, which
+     * pollClock() keeps track of between reads.
+     * @return The time since the Timer was started, as an NTP 64-bit timestamp
+     */
+    uint64_t localTime() {
+        uint32_t us = (uint32_t) _clock.read_us();
+        if (us < _lastUs) {
+            _usHigh++;
+        }
+        _lastUs = us;
+        uint64_t us64 = ((uint64_t) _usHigh << 32) | us;
+        uint64_t sec = us64 / 1000000;
+        uint64_t frac = ((us64 % 1000000) << 32) / 1000000;
+        return (sec << 32) | frac;
+    }
+    void pollClock() {
+        (void) localTime();
+    }
+    static uint64_t readTimestamp(const uint8_t *p) {
+        uint32_t sec, frac;
+        /* Correct for possible non 32-bit alignment */
+        memcpy(&sec, p, sizeof(sec));
+        memcpy(&frac, p + sizeof(sec), sizeof(frac));
+        /* Switch to host order */
+        return ((uint64_t) ntohl(sec) << 32) | ntohl(frac);
+    }
+    static void writeTimestamp(uint8_t *p, uint64_t ts) {
+        uint32_t sec = htonl((uint32_t)(ts >> 32));
+        uint32_t frac = htonl((uint32_t) ts);
+        memcpy(p, &sec, sizeof(sec));
+        memcpy(p + sizeof(sec), &frac, sizeof(frac));
+    }
+    /**
+     * Converts a (small) NTP fixed point interval to microseconds
+     */
+    static long toMicroseconds(int64_t ts) {
+        return (long) ((ts * 1000000) / ((int64_t) 1 << 32));
+    }
+
+    void cancelRetry() {
+        if (_retryHandle != NULL) {
+            minar::Scheduler::cancelCallback(_retryHandle);
+            _retryHandle = NULL;
+        }
+    }
+    /**
+     * Stops the exchange: no further requests are sent and replies are ignored
+     */
+    void stop() {
+        _done = true;
+        _lastTransmit = 0;
+        cancelRetry();
+        sock.setOnReadable(Socket::ReadableHandler_t());
+    }
+
     void sendTimeQuery(Socket* s) {
+        if (_done) {
+            return;
+        }
+        if (_nAttempts >= SNTP_MAX_ATTEMPTS) {
+            printf("Giving up after %d requests\r\n", _nAttempts);
+            finish();
+            return;
+        }
+        _nAttempts++;
+        uint8_t pkt[SNTP_PACKET_SIZE];
+        memset(pkt, 0, sizeof(pkt));
+        pkt[0] = SNTP_CLIENT_HEADER;
+        /*
+         * The server echoes the transmit timestamp back as the originate timestamp.
+         * The local clock is used directly: it is only compared against the echo,
+         * and is unique per request, so stale and duplicate replies can be dropped.
+         */
+        _lastTransmit = localTime();
+        writeTimestamp(pkt + SNTP_TRANSMIT_OFFSET, _lastTransmit);
+
         char buf[32];
         _resolvedAddr.fmtIPv4(buf, 32);
         /* Send the query packet to the remote host */
-        printf("Sending \"time\" to %s:%d\r\n", buf, (int)_udpTimePort);
-        socket_error_t err = s->send_to("time",strlen("time"), &_resolvedAddr, _udpTimePort);
+        printf("Sending SNTP request %d to %s:%d\r\n", _nAttempts, buf, (int)_udpTimePort);
+        socket_error_t err = s->send_to(pkt, sizeof(pkt), &_resolvedAddr, _udpTimePort);
         /* A failure on send is a fatal error in this example */
         if (err != SOCKET_ERROR_NONE) {
             printf("Socket Error %d\r\n", err);
+            stop();
             notify_completion(false);
         }
     }
+    /**
+     * Sends the next request in the burst, resending periodically until answered
+     * @param[in] s The socket to send on
+     * @param[in] delay_ms The time to wait before the first request
+     */
+    void scheduleTimeQuery(Socket *s, uint32_t delay_ms) {
+        mbed::util::FunctionPointer1<void, Socket*> fp(this, &UDPGetTime::sendTimeQuery);
+        _retryHandle = minar::Scheduler::postCallback(fp.bind(s))
+            .delay(minar::milliseconds(delay_ms))
+            .period(minar::milliseconds(SNTP_RETRY_MS))
+            .getHandle();
+    }
     /**
      * The DNS Response Handler
      * @param[in] arg (unused)
@@ -117,50 +313,162 @@ protected:
 
         /* Register the read handler */
         s->setOnReadable(Socket::ReadableHandler_t(this, &UDPGetTime::onRecv));
+        // Schedule a retry function before the first send, so a failed send can cancel it
+        scheduleTimeQuery(s, SNTP_RETRY_MS);
         sendTimeQuery(s);
-        // Schedule a retry function
-        mbed::util::FunctionPointer1<void, Socket*> fp(this, &UDPGetTime::sendTimeQuery);
-        _retryHandle = minar::Scheduler::postCallback(fp.bind(s)).period(minar::milliseconds(1000)).getHandle();
     }
     /**
      * The Time Query response handler
      * @param[in] arg (unused)
      */
     void onRecv(Socket *s) {
-        (void) s;
-        minar::Scheduler::cancelCallback(_retryHandle);
-        printf("Data Available!\r\n");
+        /* Timestamp the arrival before anything else */
+        const uint64_t t4 = localTime();
         /* Initialize the buffer size */
         size_t nRx = sizeof(_rxBuf);
         /* Receive some bytes */
         socket_error_t err = s->recv(_rxBuf, &nRx);
+        if (_done) {
+            return;
+        }
         /* A failure on recv is a fatal error in this example */
         if (err != SOCKET_ERROR_NONE) {
             printf("Socket Error %d\r\n", err);
+            stop();
             notify_completion(false);
+            return;
         }
-        uint32_t time;
-        /* Correct for possible non 32-bit alignment */
-        memcpy(&time, _rxBuf, sizeof(time));
-        /* Switch to host order */
-        _time = ntohl(time);
+        if (nRx < SNTP_PACKET_SIZE) {
+            printf("Short SNTP reply (%u bytes) ignored\r\n", (unsigned) nRx);
+            return;
+        }
+        const uint8_t li = _rxBuf[0] >> 6;
+        const uint8_t mode = _rxBuf[0] & 0x7;
+        const uint8_t stratum = _rxBuf[1];
+        const uint64_t t1 = readTimestamp(_rxBuf + SNTP_ORIGINATE_OFFSET);
+        const uint64_t t2 = readTimestamp(_rxBuf + SNTP_RECEIVE_OFFSET);
+        const uint64_t t3 = readTimestamp(_rxBuf + SNTP_TRANSMIT_OFFSET);
+        if (mode != SNTP_MODE_SERVER || _lastTransmit == 0 || t1 != _lastTransmit) {
+            /* Not a reply to the outstanding request */
+            return;
+        }
+        if (stratum == 0) {
+            /* Kiss-o'-Death: the server asks us to stop */
+            printf("SNTP Kiss-o'-Death received: %.4s\r\n",
+                (const char *)(_rxBuf + SNTP_REFID_OFFSET));
+            finish();
+            return;
+        }
+        if (li == SNTP_LI_ALARM || stratum > SNTP_STRATUM_MAX || t3 == 0) {
+            printf("Unsynchronized SNTP server reply ignored\r\n");
+            return;
+        }
+
+        /*
+         * delay  = (T4 - T1) - (T3 - T2)
+         * offset = ((T2 - T1) + (T3 - T4)) / 2
+         * T1 and T4 are read from the local clock, so the offset is about as large
+         * as an NTP timestamp and does not fit the signed form. It is computed
+         * instead as the unsigned midpoint difference (T2 + T3) / 2 - (T1 + T4) / 2.
+         */
+        const int64_t delay = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+        if (t3 < t2 || delay < 0) {
+            /* Timestamps are inconsistent; keep waiting for a usable reply */
+            printf("Bogus SNTP timestamps ignored\r\n");
+            return;
+        }
+        cancelRetry();
+        /* Do not accept a second reply to the same request */
+        _lastTransmit = 0;
+
+        const uint64_t offset = midpoint(t2, t3) - midpoint(t1, t4);
+        printf("Data Available! offset %lu.%03lu s, delay %ld us\r\n",
+            (unsigned long)(uint32_t)(offset >> 32),
+            (unsigned long)((((offset & 0xffffffff) * 1000) >> 32)),
+            toMicroseconds(delay));
+        _samples[_nSamples].offset = offset;
+        _samples[_nSamples].delay = delay;
+        _nSamples++;
+
+        if (_nSamples < SNTP_SAMPLES) {
+            scheduleTimeQuery(s, SNTP_BURST_INTERVAL_MS);
+        } else {
+            finish();
+        }
+    }
+    static uint64_t midpoint(uint64_t a, uint64_t b) {
+        return (a >> 1) + (b >> 1) + (a & b & 1);
+    }
+    /**
+     * Stops the exchange, selects the best sample and reports the result.
+     * Safe to call more than once; only the first call reports.
+     */
+    void finish() {
+        if (_done) {
+            return;
+        }
+        stop();
+        if (_nSamples == 0) {
+            printf("No SNTP samples received\r\n");
+            notify_completion(false);
+            return;
+        }
+        /* Keep the sample with the lowest round-trip delay (RFC 5905 clock filter) */
+        unsigned best = 0;
+        for (unsigned i = 1; i < _nSamples; i++) {
+            if (_samples[i].delay < _samples[best].delay) {
+                best = i;
+            }
+        }
+        _offset = _samples[best].offset;
+        _delay = _samples[best].delay;
+        /* Jitter is the RMS difference of the other offsets from the selected one */
+        float sumSq = 0;
+        for (unsigned i = 0; i < _nSamples; i++) {
+            float d = (float) toMicroseconds((int64_t)(_samples[i].offset - _offset));
+            sumSq += d * d;
+        }
+        _jitter = (_nSamples > 1) ? (long) sqrtf(sumSq / (_nSamples - 1)) : 0;
 
-        printf("UDP: %lu seconds since 01/01/1900 00:00 GMT\r\n", _time);
+        const uint64_t t = now();
+        _time = (uint32_t)(t >> 32);
+        const long delay_us = toMicroseconds(_delay);
+        printf("SNTP: %u samples, delay %ld us, jitter %ld us\r\n",
+            _nSamples, delay_us, _jitter);
+        printf("UDP: %lu.%03lu seconds since 01/01/1900 00:00 GMT\r\n", _time,
+            (unsigned long)((((t & 0xffffffff) * 1000) >> 32)));
         float years = (float) _time / 60 / 60 / 24 / 365;
-        printf("{{%s}}\r\n",(years < YEARS_TO_PASS ?"failure":"success"));
+        bool pass = years >= YEARS_TO_PASS && delay_us <= SNTP_MAX_DELAY_MS * 1000L;
+        printf("{{%s}}\r\n",(pass ?"success":"failure"));
         printf("{{end}}\r\n");
     }
 
 protected:
+    struct sample {
+        uint64_t offset;
+        int64_t delay;
+    };
+
     UDPSocket sock;
     SocketAddr _resolvedAddr;
     volatile bool resolved;
     const uint16_t _udpTimePort;
     volatile uint32_t _time;
     minar::callback_handle_t _retryHandle;
+    Timer _clock;
+    uint32_t _lastUs;
+    uint32_t _usHigh;
+    uint64_t _offset;
+    int64_t _delay;
+    long _jitter;
+    uint64_t _lastTransmit;
+    unsigned _nSamples;
+    int _nAttempts;
+    bool _done;
+    struct sample _samples[SNTP_SAMPLES];
 
 protected:
-    char _rxBuf[32];
+    uint8_t _rxBuf[64];
 };
 
 EthernetInterface eth;